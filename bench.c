@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "dgram.h"
+#include "message.h"
+#include "network.h"
+#include "renew.h"
+
+#define BATCH 1024U
+#define ROUNDS 2000U
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Report(const char *name, size_t n, double secs) {
+  printf("%-28s %12.0f req/s\n", name, n / secs);
+}
+
+// Keeps the compiler from discarding stores into buffers nobody reads.
+static void Consume(const void *p) {
+  __asm__ volatile("" : : "r"(p) : "memory");
+}
+
+static void BenchEncode(void) {
+  struct sockaddr_in client_addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(0xc0a80002),
+  };
+  const struct sockaddr *sa = (const struct sockaddr *)&client_addr;
+  struct ReqHdr req_hdr = {
+    .version = PCP_VERSION,
+    .opcode = OPCODE_MAP,
+    .client_ip = FixedSizeAddr(sa),
+  };
+  struct MapInfo map_info = {
+    .protocol = IPPROTO_TCP,
+    .external_ip = SuggestedExternalAddr(sa),
+  };
+  struct PreferFailureOption prefer_failure = {
+    .hdr = { OPTION_PREFER_FAILURE, LEN_OPTION_BODY_PREFER_FAILURE },
+  };
+  const struct OptionHdr *options[] = { &prefer_failure.hdr };
+
+  struct ReqFields *fields = calloc(BATCH, sizeof(*fields));
+  unsigned char *out = malloc(BATCH * LEN_MAX_PAYLOAD);
+  if (fields == NULL || out == NULL) err(EXIT_FAILURE, "malloc");
+  for (size_t i = 0; i < BATCH; ++i) {
+    NonceInit(&fields[i].mapping_nonce);
+    fields[i].requested_lifetime = 120;
+    fields[i].internal_port = fields[i].external_port = 10000 + i;
+  }
+  const size_t stride = LEN_MSG_HDR + LEN_MAP_INFO + LEN_OPTION_HDR;
+
+  double start = Now();
+  for (size_t r = 0; r < ROUNDS; ++r) {
+    for (size_t i = 0; i < BATCH; ++i) {
+      unsigned char *buf = out + i * stride, *cur;
+      req_hdr.requested_lifetime = fields[i].requested_lifetime;
+      map_info.mapping_nonce = fields[i].mapping_nonce;
+      map_info.internal_port = fields[i].internal_port;
+      map_info.external_port = fields[i].external_port;
+      cur = WriteReqHdr(&req_hdr, buf, stride);
+      cur = WriteMapInfo(&map_info, cur, stride - (cur - buf));
+      WriteOption(options[0], cur, stride - (cur - buf));
+    }
+    Consume(out);
+  }
+  Report("encode/per-field", BATCH * ROUNDS, Now() - start);
+
+  struct ReqTemplate tmpl;
+  if (!ReqTemplateInit(&tmpl, &req_hdr, &map_info, options, 1)) {
+    errx(EXIT_FAILURE, "ReqTemplateInit failed");
+  }
+  start = Now();
+  for (size_t r = 0; r < ROUNDS; ++r) {
+    WriteReqBatch(&tmpl, fields, BATCH, out, stride);
+    Consume(out);
+  }
+  Report("encode/template", BATCH * ROUNDS, Now() - start);
+  free(out);
+  free(fields);
+}
+
+// Fills out with BATCH MAP responses, one every LEN_MAX_PAYLOAD bytes.
+static void FillMapResps(unsigned char *out, size_t lens[]) {
+  for (size_t i = 0; i < BATCH; ++i) {
+    unsigned char *p = out + i * LEN_MAX_PAYLOAD;
+    struct MapInfo info = {
+      .protocol = IPPROTO_UDP,
+      .internal_port = 10000 + i,
+      .external_port = 20000 + i,
+      .external_ip = Map4To6((struct in_addr){ htonl(0xcb007100 + i) }),
+    };
+    NonceInit(&info.mapping_nonce);
+    memset(p, 0, LEN_MSG_HDR);
+    p[0] = PCP_VERSION;
+    p[1] = 0x80 | OPCODE_MAP;
+    p[3] = i % 16 == 0 ? RC_NO_RESOURCES : RC_SUCCESS;
+    p[7] = 120;
+    p[11] = i & 0xff;
+    WriteMapInfo(&info, p + LEN_MSG_HDR, LEN_MAP_INFO);
+    lens[i] = LEN_MSG_HDR + LEN_MAP_INFO;
+  }
+}
+
+static void BenchDecode(void) {
+  unsigned char *in = malloc(BATCH * LEN_MAX_PAYLOAD);
+  size_t *lens = calloc(BATCH, sizeof(*lens));
+  struct RespHdr *hdrs = calloc(BATCH, sizeof(*hdrs));
+  struct MapInfo *infos = calloc(BATCH, sizeof(*infos));
+  struct MapRespBatch batch = {
+    .valid = calloc(BATCH, sizeof(*batch.valid)),
+    .result_code = calloc(BATCH, sizeof(*batch.result_code)),
+    .lifetime = calloc(BATCH, sizeof(*batch.lifetime)),
+    .epoch_time = calloc(BATCH, sizeof(*batch.epoch_time)),
+    .mapping_nonce = calloc(BATCH, sizeof(*batch.mapping_nonce)),
+    .internal_port = calloc(BATCH, sizeof(*batch.internal_port)),
+    .external_port = calloc(BATCH, sizeof(*batch.external_port)),
+    .external_ip = calloc(BATCH, sizeof(*batch.external_ip)),
+  };
+  if (in == NULL || lens == NULL || hdrs == NULL || infos == NULL ||
+      batch.valid == NULL || batch.result_code == NULL ||
+      batch.lifetime == NULL || batch.epoch_time == NULL ||
+      batch.mapping_nonce == NULL || batch.internal_port == NULL ||
+      batch.external_port == NULL || batch.external_ip == NULL) {
+    err(EXIT_FAILURE, "malloc");
+  }
+  FillMapResps(in, lens);
+  size_t n_ok = 0;
+
+  double start = Now();
+  for (size_t r = 0; r < ROUNDS; ++r) {
+    for (size_t i = 0; i < BATCH; ++i) {
+      const unsigned char *p = in + i * LEN_MAX_PAYLOAD;
+      if (lens[i] < LEN_MSG_HDR || lens[i] > LEN_MAX_PAYLOAD ||
+          (lens[i] & 0x3) != 0) {
+        continue;
+      }
+      const unsigned char *cur = ReadRespHdr(p, lens[i], &hdrs[i]);
+      cur = ReadMapInfo(cur, lens[i] - (cur - p), &infos[i]);
+      n_ok += cur != NULL && hdrs[i].version == PCP_VERSION &&
+              hdrs[i].r_opcode == (0x80 | OPCODE_MAP);
+    }
+    Consume(hdrs);
+    Consume(infos);
+  }
+  Report("decode/per-field", BATCH * ROUNDS, Now() - start);
+
+  size_t n_batch_ok = 0;
+  start = Now();
+  for (size_t r = 0; r < ROUNDS; ++r) {
+    n_batch_ok += ReadMapRespBatch(in, LEN_MAX_PAYLOAD, lens, BATCH, &batch);
+    Consume(&batch);
+  }
+  Report("decode/batch", BATCH * ROUNDS, Now() - start);
+
+  for (size_t i = 0; i < BATCH; ++i) {
+    if (!batch.valid[i] || batch.result_code[i] != hdrs[i].result_code ||
+        batch.lifetime[i] != hdrs[i].lifetime ||
+        batch.epoch_time[i] != hdrs[i].epoch_time ||
+        memcmp(&batch.mapping_nonce[i], &infos[i].mapping_nonce,
+               sizeof(infos[i].mapping_nonce)) != 0 ||
+        batch.internal_port[i] != infos[i].internal_port ||
+        batch.external_port[i] != infos[i].external_port ||
+        memcmp(&batch.external_ip[i], &infos[i].external_ip,
+               sizeof(infos[i].external_ip)) != 0) {
+      errx(EXIT_FAILURE, "Batch decoder mismatch at %zu", i);
+    }
+  }
+  if (n_ok != n_batch_ok) errx(EXIT_FAILURE, "Batch decoder count mismatch");
+
+  free(batch.valid);
+  free(batch.result_code);
+  free(batch.lifetime);
+  free(batch.epoch_time);
+  free(batch.mapping_nonce);
+  free(batch.internal_port);
+  free(batch.external_port);
+  free(batch.external_ip);
+  free(infos);
+  free(hdrs);
+  free(lens);
+  free(in);
+}
+
+// Loopback UDP socket connected to itself.
+static int LoopbackSocket(void) {
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t addr_len = sizeof(addr);
+  int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock_fd == -1 ||
+      bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      getsockname(sock_fd, (struct sockaddr *)&addr, &addr_len) == -1 ||
+      connect(sock_fd, (struct sockaddr *)&addr, addr_len) == -1) {
+    err(EXIT_FAILURE, "Failed to set up loopback socket");
+  }
+  return sock_fd;
+}
+
+static void BenchDgram(const char *name, enum DgramBackend backend) {
+  // Stays below the socket receive buffer so that nothing is dropped.
+  const size_t burst = 64;
+  const size_t len = LEN_MSG_HDR + LEN_MAP_INFO;
+  const size_t rounds = ROUNDS * 4;
+  int sock_fd = LoopbackSocket();
+  struct DgramIo io;
+  if (DgramIoInit(&io, sock_fd, backend) != backend) {
+    printf("%-28s %12s\n", name, "unavailable");
+    close(sock_fd);
+    return;
+  }
+  unsigned char *out = calloc(burst, len);
+  unsigned char in[LEN_MAX_PAYLOAD];
+  if (out == NULL) err(EXIT_FAILURE, "malloc");
+
+  double start = Now();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (size_t i = 0; i < burst; ++i) {
+      if (DgramSend(&io, out + i * len, len) == -1) err(EXIT_FAILURE, "send");
+    }
+    if (DgramFlush(&io) == -1) err(EXIT_FAILURE, "send");
+    for (size_t i = 0; i < burst; ++i) {
+      if (DgramRecv(&io, in, sizeof(in), -1) != (ssize_t)len) {
+        err(EXIT_FAILURE, "recv");
+      }
+    }
+  }
+  Report(name, burst * rounds, Now() - start);
+
+  DgramIoClose(&io);
+  close(sock_fd);
+  free(out);
+}
+
+#define N_MAPPINGS 1000000U
+
+struct DueStats {
+  uint32_t *per_sec;
+  size_t n_secs;
+};
+
+static void CountDue(struct RenewEntry *entry, void *arg) {
+  struct DueStats *stats = arg;
+  size_t sec = entry->deadline / 1000;
+  if (sec < stats->n_secs) ++stats->per_sec[sec];
+}
+
+static void BenchRenew(void) {
+  const uint32_t lifetime = 3600, new_lifetime = 7200;
+  struct RenewSched *sched = malloc(sizeof(*sched));
+  struct RenewEntry *entries = calloc(N_MAPPINGS, sizeof(*entries));
+  struct DueStats stats = { .n_secs = new_lifetime };
+  stats.per_sec = calloc(stats.n_secs, sizeof(*stats.per_sec));
+  if (sched == NULL || entries == NULL || stats.per_sec == NULL) {
+    err(EXIT_FAILURE, "malloc");
+  }
+  RenewSchedInit(sched, 0);
+
+  double start = Now();
+  for (size_t i = 0; i < N_MAPPINGS; ++i) {
+    RenewSchedAdd(sched, &entries[i], lifetime);
+  }
+  Report("renew/add", N_MAPPINGS, Now() - start);
+
+  start = Now();
+  for (size_t i = 0; i < N_MAPPINGS; ++i) {
+    RenewSchedAdd(sched, &entries[i], new_lifetime);
+  }
+  Report("renew/reschedule", N_MAPPINGS, Now() - start);
+
+  start = Now();
+  size_t n_due = RenewSchedAdvance(sched, new_lifetime * 1000ULL, CountDue,
+      &stats);
+  Report("renew/advance", n_due, Now() - start);
+  if (n_due != N_MAPPINGS) errx(EXIT_FAILURE, "Lost renewals: %zu", n_due);
+
+  // Renewals fall in [1/2, 5/8] of the lifetime.
+  uint32_t peak = 0;
+  size_t lo = new_lifetime / 2, hi = new_lifetime * 5 / 8;
+  for (size_t sec = lo; sec < hi; ++sec) {
+    if (stats.per_sec[sec] > peak) peak = stats.per_sec[sec];
+  }
+  printf("%-28s %12.3f\n", "renew/peak-to-mean",
+         peak / ((double)N_MAPPINGS / (hi - lo)));
+
+  free(stats.per_sec);
+  free(entries);
+  free(sched);
+}
+
+int main(void) {
+  BenchEncode();
+  BenchDecode();
+  BenchDgram("dgram/socket", DGRAM_BACKEND_SOCKET);
+  BenchDgram("dgram/io_uring", DGRAM_BACKEND_URING);
+  BenchRenew();
+  return 0;
+}
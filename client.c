@@ -10,16 +10,19 @@
 #include <netinet/in.h>
 #include <unistd.h>
 
+#include "dgram.h"
+#include "manager.h"
 #include "message.h"
 #include "network.h"
+#include "trace.h"
 
-static ssize_t SendMapReq(int sock_fd,
-                          const struct sockaddr* client_addr,
-                          struct Nonce mapping_nonce,
-                          uint8_t protocol,
-                          uint16_t port,
-                          uint32_t requested_lifetime,
-                          bool prefer_failure) {
+static int SendMapReq(struct DgramIo *io,
+                      const struct sockaddr* client_addr,
+                      struct Nonce mapping_nonce,
+                      uint8_t protocol,
+                      uint16_t port,
+                      uint32_t requested_lifetime,
+                      bool prefer_failure) {
   struct ReqHdr req_hdr = {
     .version = PCP_VERSION,
     .opcode = OPCODE_MAP,
@@ -45,12 +48,13 @@ static ssize_t SendMapReq(int sock_fd,
         sizeof(buf) - (cur - buf));
   }
 
-  return send(sock_fd, buf, cur - buf, 0);
+  if (DgramSend(io, buf, cur - buf) == -1) return -1;
+  return DgramFlush(io);
 }
 
-static void RecvMapResp(int sock_fd, struct Nonce nonce) {
+static void RecvMapResp(struct DgramIo *io, struct Nonce nonce) {
   unsigned char buf[1280];
-  ssize_t size = recv(sock_fd, buf, sizeof(buf), 0);
+  ssize_t size = DgramRecv(io, buf, sizeof(buf), -1);
   if (size == -1) {
     err(EXIT_FAILURE, "Failed to recv map response");
   }
@@ -98,25 +102,12 @@ static void RecvMapResp(int sock_fd, struct Nonce nonce) {
          "Internal port: %" PRIu16 "\n"
          "External port: %" PRIu16 "\n",
          map_info.protocol, map_info.internal_port, map_info.external_port);
-  if (IN6_IS_ADDR_V4MAPPED(&map_info.external_ip)) {
-    char str[INET_ADDRSTRLEN];
-    struct in_addr ipv4 = Map6To4(map_info.external_ip);
-    inet_ntop(AF_INET, &ipv4, str, sizeof(str));
-    printf("External IP: %s\n", str);
-  } else {
-    char str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &map_info.external_ip, str, sizeof(str));
-    printf("External IP: %s\n", str);
-  }
+  char str[INET6_ADDRSTRLEN];
+  printf("External IP: %s\n",
+         FormatAddr(&map_info.external_ip, str, sizeof(str)));
 }
 
-int RunClient(const struct sockaddr* svr_addr,
-              const struct sockaddr* client_addr,
-              socklen_t sa_len,
-              uint8_t protocol,
-              uint16_t port,
-              uint32_t timeout,
-              bool prefer_failure) {
+static void MapPort(struct DgramIo *io, const struct ClientConfig *config) {
   struct Nonce mapping_nonce;
   NonceInit(&mapping_nonce);
   printf("Mapping nonce: ");
@@ -125,18 +116,45 @@ int RunClient(const struct sockaddr* svr_addr,
   }
   putchar('\n');
 
-  int sock_fd = socket(svr_addr->sa_family, SOCK_DGRAM, 0);
-  if (bind(sock_fd, client_addr, sa_len) == -1) {
+  int sent = SendMapReq(io, config->client_addr, mapping_nonce,
+      config->protocol, config->first_port, config->lifetime,
+      config->prefer_failure);
+  if (sent == -1) err(EXIT_FAILURE, "Failed to send PCP MAP request");
+  RecvMapResp(io, mapping_nonce);
+}
+
+int RunClient(const struct ClientConfig *config) {
+  int sock_fd = socket(config->svr_addr->sa_family, SOCK_DGRAM, 0);
+  if (bind(sock_fd, config->client_addr, config->sa_len) == -1) {
     err(EXIT_FAILURE, "Failed to bind local address");
   }
-  if (connect(sock_fd, svr_addr, sa_len) == -1) {
+  if (connect(sock_fd, config->svr_addr, config->sa_len) == -1) {
     err(EXIT_FAILURE, "Failed to connect");
   }
 
-  ssize_t sent = SendMapReq(sock_fd, client_addr, mapping_nonce, protocol, port,
-      timeout, prefer_failure);
-  if (sent == -1) err(EXIT_FAILURE, "Failed to send PCP MAP request");
-  RecvMapResp(sock_fd, mapping_nonce);
+  struct DgramIo io;
+  enum DgramBackend backend =
+      config->use_uring ? DGRAM_BACKEND_URING : DGRAM_BACKEND_SOCKET;
+  if (DgramIoInit(&io, sock_fd, backend) != backend) {
+    warnx("io_uring is unavailable, falling back to socket I/O");
+  }
+  struct TraceWriter trace;
+  if (config->trace_path != NULL) {
+    if (TraceWriterOpen(&trace, config->trace_path,
+                        TRACE_DEFAULT_CAPACITY) == -1) {
+      err(EXIT_FAILURE, "Failed to open trace file %s", config->trace_path);
+    }
+    io.trace = &trace;
+  }
+
+  int ret = 0;
+  if (config->first_port == config->last_port && !config->keep) {
+    MapPort(&io, config);
+  } else {
+    ret = RunManager(&io, config);
+  }
+  DgramIoClose(&io);
+  if (io.trace != NULL) TraceWriterClose(io.trace);
   close(sock_fd);
-  return 0;
+  return ret;
 }
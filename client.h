@@ -5,12 +5,22 @@
 #include <stdint.h>
 #include <sys/socket.h>
 
-int RunClient(const struct sockaddr* svr_addr,
-              const struct sockaddr* local_addr,
-              socklen_t sa_len,
-              uint8_t protocol,
-              uint16_t port,
-              uint32_t timeout,
-              bool prefer_failure);
+struct ClientConfig {
+  const struct sockaddr *svr_addr;
+  const struct sockaddr *client_addr;
+  socklen_t sa_len;
+  uint8_t protocol;
+  uint16_t first_port;
+  uint16_t last_port;
+  uint32_t lifetime;
+  bool prefer_failure;
+  bool use_uring;
+  // Keep the mappings renewed until SIGTERM or SIGINT, then release them.
+  bool keep;
+  // Record every datagram sent and received to this file, if set.
+  const char *trace_path;
+};
+
+int RunClient(const struct ClientConfig *config);
 
 #endif
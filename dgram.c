@@ -0,0 +1,379 @@
+#include "dgram.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "message.h"
+#include "trace.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_URING 1
+#endif
+
+#ifdef HAVE_URING
+
+// One spare word so that oversized responses are still detected.
+#define URING_BUF_LEN (LEN_MAX_PAYLOAD + 4U)
+#define URING_BGID 0
+#define URING_UD_RECV 1
+#define URING_UD_SEND 2
+
+struct DgramUring {
+  int ring_fd;
+  void *ring_ptr;
+  size_t ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned to_submit;
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_len;
+  uint16_t buf_tail;
+  unsigned char *bufs;
+
+  int sock_fd;
+  bool recv_armed;
+  int recv_error;
+  unsigned sends_inflight;
+  int send_error;
+
+  // Completed receives not yet handed out by DgramRecv().
+  struct {
+    uint16_t bid;
+    uint32_t len;
+  } ready[DGRAM_URING_ENTRIES];
+  unsigned ready_head, ready_count;
+};
+
+static int UringSetup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int UringEnter(int fd, unsigned to_submit, unsigned min_complete,
+                      unsigned flags,
+                      const struct io_uring_getevents_arg *arg) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 arg, arg != NULL ? sizeof(*arg) : 0);
+}
+
+static int UringRegister(int fd, unsigned opcode, void *arg, unsigned n) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+static void UringFree(struct DgramUring *u) {
+  if (u->buf_ring != NULL) {
+    struct io_uring_buf_reg reg = { .bgid = URING_BGID };
+    UringRegister(u->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(u->buf_ring, u->buf_ring_len);
+  }
+  if (u->sqes != NULL) munmap(u->sqes, u->sqes_len);
+  if (u->ring_ptr != NULL) munmap(u->ring_ptr, u->ring_len);
+  if (u->ring_fd >= 0) close(u->ring_fd);
+  free(u->bufs);
+  free(u);
+}
+
+static void UringRecycle(struct DgramUring *u, uint16_t bid) {
+  const uint16_t mask = DGRAM_URING_ENTRIES - 1;
+  struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & mask];
+  buf->addr = (uintptr_t)(u->bufs + (size_t)bid * URING_BUF_LEN);
+  buf->len = URING_BUF_LEN;
+  buf->bid = bid;
+  __atomic_store_n(&u->buf_ring->tail, ++u->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Returns a zeroed SQE, or NULL if the submission queue is full.
+static struct io_uring_sqe *UringGetSqe(struct DgramUring *u) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *u->sq_tail;
+  if (tail - head >= u->sq_entries) return NULL;
+  unsigned idx = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++u->to_submit;
+  return sqe;
+}
+
+// Submits queued SQEs without waiting for completions.
+static int UringSubmit(struct DgramUring *u) {
+  for (;;) {
+    int ret = UringEnter(u->ring_fd, u->to_submit, 0, 0, NULL);
+    if (ret >= 0) {
+      u->to_submit -= ret;
+      return 0;
+    }
+    if (errno != EINTR) return -1;
+  }
+}
+
+// Submits queued SQEs and waits for a CQE, for at most timeout_ms if it is
+// not negative. Fails with EAGAIN on timeout and EINTR on a signal.
+static int UringWait(struct DgramUring *u, int timeout_ms) {
+  struct __kernel_timespec ts = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+  };
+  struct io_uring_getevents_arg arg = {
+    .ts = timeout_ms >= 0 ? (uintptr_t)&ts : 0,
+  };
+  int ret = UringEnter(u->ring_fd, u->to_submit, 1,
+      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+  if (ret >= 0) {
+    u->to_submit -= ret;
+    return 0;
+  }
+  if (errno == ETIME) errno = EAGAIN;
+  return -1;
+}
+
+static void UringArmRecv(struct DgramUring *u) {
+  struct io_uring_sqe *sqe = UringGetSqe(u);
+  if (sqe == NULL) return;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = u->sock_fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = URING_UD_RECV;
+  u->recv_armed = true;
+}
+
+// Drains the completion queue without blocking.
+static void UringReap(struct DgramUring *u) {
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    if (cqe->user_data == URING_UD_SEND) {
+      --u->sends_inflight;
+      if (cqe->res < 0 && u->send_error == 0) u->send_error = -cqe->res;
+      continue;
+    }
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0) u->recv_armed = false;
+    if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+      unsigned slot = (u->ready_head + u->ready_count) % DGRAM_URING_ENTRIES;
+      u->ready[slot].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      u->ready[slot].len = cqe->res;
+      ++u->ready_count;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+      u->recv_error = -cqe->res;
+    }
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct DgramUring *UringInit(int sock_fd) {
+  struct DgramUring *u = calloc(1, sizeof(*u));
+  if (u == NULL) return NULL;
+  u->ring_fd = -1;
+  u->sock_fd = sock_fd;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  u->ring_fd = UringSetup(2 * DGRAM_URING_ENTRIES, &params);
+  const unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+  if (u->ring_fd < 0 || (params.features & features) != features) {
+    goto fail;
+  }
+  size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_len = params.cq_off.cqes +
+                  params.cq_entries * sizeof(struct io_uring_cqe);
+  u->ring_len = sq_len > cq_len ? sq_len : cq_len;
+  u->ring_ptr = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+  if (u->ring_ptr == MAP_FAILED) {
+    u->ring_ptr = NULL;
+    goto fail;
+  }
+  u->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    u->sqes = NULL;
+    goto fail;
+  }
+  unsigned char *ring = u->ring_ptr;
+  u->sq_head = (unsigned *)(ring + params.sq_off.head);
+  u->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+  u->sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(ring + params.sq_off.array);
+  u->cq_head = (unsigned *)(ring + params.cq_off.head);
+  u->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+  u->cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+  u->sq_entries = params.sq_entries;
+
+  u->bufs = malloc((size_t)DGRAM_URING_ENTRIES * URING_BUF_LEN);
+  if (u->bufs == NULL) goto fail;
+  u->buf_ring_len = DGRAM_URING_ENTRIES * sizeof(struct io_uring_buf);
+  u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->buf_ring == MAP_FAILED) {
+    u->buf_ring = NULL;
+    goto fail;
+  }
+  struct io_uring_buf_reg reg = {
+    .ring_addr = (uintptr_t)u->buf_ring,
+    .ring_entries = DGRAM_URING_ENTRIES,
+    .bgid = URING_BGID,
+  };
+  if (UringRegister(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    munmap(u->buf_ring, u->buf_ring_len);
+    u->buf_ring = NULL;
+    goto fail;
+  }
+  for (unsigned bid = 0; bid < DGRAM_URING_ENTRIES; ++bid) {
+    UringRecycle(u, bid);
+  }
+
+  // Kernels without multishot recv reject the SQE while it is submitted, so
+  // the error is already in the completion queue when this returns.
+  UringArmRecv(u);
+  if (UringSubmit(u) != 0) goto fail;
+  UringReap(u);
+  if (u->recv_error != 0) goto fail;
+  return u;
+
+fail:
+  UringFree(u);
+  return NULL;
+}
+
+#endif
+
+enum DgramBackend DgramIoInit(struct DgramIo *io, int sock_fd,
+                              enum DgramBackend preferred) {
+  io->backend = DGRAM_BACKEND_SOCKET;
+  io->sock_fd = sock_fd;
+  io->uring = NULL;
+  io->trace = NULL;
+#ifdef HAVE_URING
+  if (preferred == DGRAM_BACKEND_URING) {
+    io->uring = UringInit(sock_fd);
+    if (io->uring != NULL) io->backend = DGRAM_BACKEND_URING;
+  }
+#else
+  (void)preferred;
+#endif
+  return io->backend;
+}
+
+// With the io_uring backend, buf must stay valid until DgramFlush() returns.
+int DgramSend(struct DgramIo *io, const void *buf, size_t len) {
+  if (io->trace != NULL) TraceAppend(io->trace, TRACE_SENT, buf, len);
+#ifdef HAVE_URING
+  if (io->backend == DGRAM_BACKEND_URING) {
+    struct DgramUring *u = io->uring;
+    struct io_uring_sqe *sqe;
+    if (u->sends_inflight + 1 >= DGRAM_URING_ENTRIES ||
+        (sqe = UringGetSqe(u)) == NULL) {
+      if (DgramFlush(io) != 0) return -1;
+      sqe = UringGetSqe(u);
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = u->sock_fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = URING_UD_SEND;
+    ++u->sends_inflight;
+    return 0;
+  }
+#endif
+  return send(io->sock_fd, buf, len, 0) == -1 ? -1 : 0;
+}
+
+int DgramFlush(struct DgramIo *io) {
+#ifdef HAVE_URING
+  if (io->backend == DGRAM_BACKEND_URING) {
+    struct DgramUring *u = io->uring;
+    if (UringSubmit(u) != 0) return -1;
+    UringReap(u);
+    while (u->sends_inflight > 0) {
+      if (UringWait(u, -1) != 0 && errno != EINTR) return -1;
+      UringReap(u);
+    }
+    if (u->send_error != 0) {
+      errno = u->send_error;
+      u->send_error = 0;
+      return -1;
+    }
+  }
+#else
+  (void)io;
+#endif
+  return 0;
+}
+
+/*
+ * Receives one datagram, waiting at most timeout_ms milliseconds or forever
+ * if it is negative. Fails with EAGAIN on timeout and EINTR if interrupted by
+ * a signal.
+ */
+ssize_t DgramRecv(struct DgramIo *io, void *buf, size_t len,
+                  int timeout_ms) {
+#ifdef HAVE_URING
+  if (io->backend == DGRAM_BACKEND_URING) {
+    struct DgramUring *u = io->uring;
+    UringReap(u);
+    while (u->ready_count == 0) {
+      if (u->recv_error != 0) {
+        errno = u->recv_error;
+        u->recv_error = 0;
+        return -1;
+      }
+      if (!u->recv_armed) UringArmRecv(u);
+      if (UringWait(u, timeout_ms) != 0) return -1;
+      UringReap(u);
+    }
+    uint16_t bid = u->ready[u->ready_head].bid;
+    size_t size = u->ready[u->ready_head].len;
+    u->ready_head = (u->ready_head + 1) % DGRAM_URING_ENTRIES;
+    --u->ready_count;
+    const unsigned char *data = u->bufs + (size_t)bid * URING_BUF_LEN;
+    if (io->trace != NULL) TraceAppend(io->trace, TRACE_RECV, data, size);
+    if (size > len) size = len;
+    memcpy(buf, data, size);
+    UringRecycle(u, bid);
+    return size;
+  }
+#endif
+  if (timeout_ms >= 0) {
+    struct pollfd pfd = { .fd = io->sock_fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready == -1) return -1;
+    if (ready == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  ssize_t size = recv(io->sock_fd, buf, len, 0);
+  if (size >= 0 && io->trace != NULL) {
+    TraceAppend(io->trace, TRACE_RECV, buf, size);
+  }
+  return size;
+}
+
+void DgramIoClose(struct DgramIo *io) {
+#ifdef HAVE_URING
+  if (io->uring != NULL) UringFree(io->uring);
+#endif
+  io->uring = NULL;
+  io->backend = DGRAM_BACKEND_SOCKET;
+}
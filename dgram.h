@@ -0,0 +1,42 @@
+#ifndef PCP_DGRAM_H
+#define PCP_DGRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum DgramBackend {
+  DGRAM_BACKEND_SOCKET = 0,
+  DGRAM_BACKEND_URING = 1,
+};
+
+// Number of receive buffers and the most sends queued before a flush.
+#define DGRAM_URING_ENTRIES 256U
+
+struct DgramUring;
+struct TraceWriter;
+
+/*
+ * Datagram I/O on a connected UDP socket. With the io_uring backend, receives
+ * are served by one multishot recv from a registered buffer ring and sends are
+ * queued until DgramFlush() submits them together; the socket backend issues
+ * one syscall per datagram. If trace is set, every datagram sent or received
+ * is appended to it.
+ */
+struct DgramIo {
+  enum DgramBackend backend;
+  int sock_fd;
+  struct DgramUring *uring;
+  struct TraceWriter *trace;
+};
+
+enum DgramBackend DgramIoInit(struct DgramIo *io, int sock_fd,
+                              enum DgramBackend preferred);
+int DgramSend(struct DgramIo *io, const void *buf, size_t len);
+int DgramFlush(struct DgramIo *io);
+ssize_t DgramRecv(struct DgramIo *io, void *buf, size_t len,
+                  int timeout_ms);
+void DgramIoClose(struct DgramIo *io);
+
+#endif
@@ -18,14 +18,18 @@
 
 static void usage(FILE* f) {
   fprintf(f, "Usage:\n"
-      "\tpcpclient -s <server_address> -l <local_address> -p <port>\n"
-      "\t          [-t | -u] [-d <timeout>]\n");
+      "\tpcpclient -s <server_address> -l <local_address>\n"
+      "\t          -p <port>[-<last_port>] [-t | -u] [-d <timeout>]\n"
+      "\t          [-f] [-i] [-k] [-w <trace_file>]\n");
 }
 
 int main(int argc, char *argv[]) {
   bool prefer_failure = false;
+  bool use_uring = false;
+  bool keep = false;
+  const char *trace_path = NULL;
   uint8_t protocol = IPPROTO_TCP;
-  uint16_t port = 0;
+  uint16_t port = 0, last_port = 0;
   uint32_t timeout = 120;
   struct addrinfo hint, *svr_ai = NULL, *local_ai = NULL;
   memset(&hint, 0, sizeof(hint));
@@ -35,7 +39,7 @@ int main(int argc, char *argv[]) {
   hint.ai_flags = AI_ADDRCONFIG | AI_NUMERICHOST | AI_NUMERICSERV;
 
   int ch;
-  while ((ch = getopt(argc, argv, "s:l:p:d:tufh")) != -1) {
+  while ((ch = getopt(argc, argv, "s:l:p:d:tufikw:h")) != -1) {
     switch (ch) {
       case 's':
         if (getaddrinfo(optarg, XSTR(PCP_SERVER_PORT), &hint, &svr_ai) != 0) {
@@ -50,9 +54,12 @@ int main(int argc, char *argv[]) {
       case 'h':
         usage(stdout);
         exit(EXIT_SUCCESS);
-      case 'p':
+      case 'p': {
+        char *range = strchr(optarg, '-');
         port = atoi(optarg);
+        last_port = range != NULL ? atoi(range + 1) : port;
         break;
+      }
       case 'd':
         timeout = atoi(optarg);
         break;
@@ -65,13 +72,22 @@ int main(int argc, char *argv[]) {
       case 'f':
         prefer_failure = true;
         break;
+      case 'i':
+        use_uring = true;
+        break;
+      case 'k':
+        keep = true;
+        break;
+      case 'w':
+        trace_path = optarg;
+        break;
       case '?':
       default:
         usage(stderr);
         exit(EXIT_FAILURE);
     }
   }
-  if (svr_ai == NULL || local_ai == NULL || port == 0) {
+  if (svr_ai == NULL || local_ai == NULL || port == 0 || last_port < port) {
     usage(stderr);
     exit(EXIT_FAILURE);
   }
@@ -81,13 +97,20 @@ int main(int argc, char *argv[]) {
     errx(EXIT_FAILURE, "Address family mismatch");
   }
 
-  if (RunClient(svr_ai->ai_addr,
-                local_ai ? local_ai->ai_addr : NULL,
-                svr_ai->ai_addrlen,
-                protocol,
-                port,
-                timeout,
-                prefer_failure) == -1) {
+  struct ClientConfig config = {
+    .svr_addr = svr_ai->ai_addr,
+    .client_addr = local_ai ? local_ai->ai_addr : NULL,
+    .sa_len = svr_ai->ai_addrlen,
+    .protocol = protocol,
+    .first_port = port,
+    .last_port = last_port,
+    .lifetime = timeout,
+    .prefer_failure = prefer_failure,
+    .use_uring = use_uring,
+    .keep = keep,
+    .trace_path = trace_path,
+  };
+  if (RunClient(&config) == -1) {
     err(EXIT_FAILURE, "RunClient failed");
   }
 
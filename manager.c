@@ -0,0 +1,436 @@
+#include "manager.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <netinet/in.h>
+
+#include "message.h"
+#include "network.h"
+#include "renew.h"
+
+// Requests sent but not yet answered.
+#define WINDOW 64U
+// Responses drained per wakeup.
+#define RECV_BURST 64U
+// Receive buffers are one word larger to catch oversized responses.
+#define RECV_BUF_LEN (LEN_MAX_PAYLOAD + 4U)
+// Outstanding requests are presumed lost after this long without a response.
+#define RTO_MS 250
+#define MAP_DEADLINE_MS 10000U
+#define RELEASE_DEADLINE_MS 3000U
+#define IDLE_WAIT_MS 1000
+// Delay before retrying a renewal that was not answered.
+#define RENEW_RETRY_MS 5000U
+
+struct Mapping {
+  struct RenewEntry renew;  // Must be the first member.
+  struct Nonce nonce;
+  struct in6_addr external_ip;
+  uint32_t lifetime;
+  uint16_t external_port;
+  bool pending;
+  bool mapped;
+  // A request with a nonzero lifetime went out with this nonce, so the server
+  // may hold the mapping even if no response confirmed it.
+  bool requested;
+};
+
+struct Manager {
+  struct DgramIo *io;
+  struct ReqTemplate tmpl;
+  uint32_t requested_lifetime;
+  uint16_t first_port;
+  struct Mapping *mappings;
+  size_t n_mappings;
+  size_t n_pending;
+  struct RenewSched *sched;
+
+  unsigned char out[WINDOW][LEN_MAX_PAYLOAD];
+  unsigned char in[RECV_BURST][RECV_BUF_LEN];
+  size_t in_lens[RECV_BURST];
+  uint8_t valid[RECV_BURST];
+  uint8_t result_code[RECV_BURST];
+  uint32_t lifetime[RECV_BURST];
+  uint32_t epoch_time[RECV_BURST];
+  struct Nonce mapping_nonce[RECV_BURST];
+  uint16_t internal_port[RECV_BURST];
+  uint16_t external_port[RECV_BURST];
+  struct in6_addr external_ip[RECV_BURST];
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void OnStopSignal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static uint64_t NowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void InitTemplate(struct Manager *mgr,
+                         const struct ClientConfig *config) {
+  struct ReqHdr req_hdr = {
+    .version = PCP_VERSION,
+    .opcode = OPCODE_MAP,
+    .client_ip = FixedSizeAddr(config->client_addr),
+  };
+  struct MapInfo map_info = {
+    .protocol = config->protocol,
+    .external_ip = SuggestedExternalAddr(config->client_addr),
+  };
+  struct PreferFailureOption prefer_failure = {
+    .hdr = { OPTION_PREFER_FAILURE, LEN_OPTION_BODY_PREFER_FAILURE },
+  };
+  const struct OptionHdr *options[] = { &prefer_failure.hdr };
+  if (!ReqTemplateInit(&mgr->tmpl, &req_hdr, &map_info, options,
+                       config->prefer_failure ? 1 : 0)) {
+    errx(EXIT_FAILURE, "Failed to encode PCP MAP request");
+  }
+}
+
+// Errors a connected UDP socket reports while the server or the path to it
+// is down, typically from an ICMP error for an earlier datagram.
+static bool IsTransient(int errnum) {
+  switch (errnum) {
+    case EAGAIN:
+    case EINTR:
+    case ENOBUFS:
+    case ECONNREFUSED:
+    case ECONNRESET:
+    case EHOSTDOWN:
+    case EHOSTUNREACH:
+    case ENETDOWN:
+    case ENETUNREACH:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Send failures are treated as lost datagrams; the requests are retransmitted
+// like any other unanswered ones.
+static void SendReqs(struct Manager *mgr, const struct ReqFields fields[],
+                     size_t n) {
+  WriteReqBatch(&mgr->tmpl, fields, n, mgr->out, sizeof(mgr->out[0]));
+  int send_errno = 0;
+  for (size_t i = 0; i < n && send_errno == 0; ++i) {
+    if (DgramSend(mgr->io, mgr->out[i], mgr->tmpl.len) == -1) {
+      send_errno = errno;
+    }
+  }
+  if (DgramFlush(mgr->io) == -1 && send_errno == 0) send_errno = errno;
+  if (send_errno != 0 && !IsTransient(send_errno)) {
+    warnx("Failed to send PCP MAP request: %s", strerror(send_errno));
+  }
+}
+
+// Waits up to timeout_ms for a response, then drains whatever else has
+// already arrived. Returns the number of datagrams received. Receive errors
+// do not cut the wait short, so that retransmissions stay paced while the
+// server is unreachable; a signal does.
+static size_t RecvResps(struct Manager *mgr, int timeout_ms) {
+  uint64_t until = NowMs() + timeout_ms;
+  size_t n = 0;
+  while (n < RECV_BURST) {
+    int wait_ms = 0;
+    if (n == 0) {
+      uint64_t now = NowMs();
+      if (now >= until) break;
+      wait_ms = until - now;
+    }
+    ssize_t size = DgramRecv(mgr->io, mgr->in[n], RECV_BUF_LEN, wait_ms);
+    if (size == -1) {
+      if (n > 0 || errno == EAGAIN || errno == EINTR) break;
+      if (!IsTransient(errno)) warn("Failed to recv map response");
+      continue;
+    }
+    mgr->in_lens[n++] = size;
+  }
+  return n;
+}
+
+// Result codes that RFC 6887 section 7.4 gives a short lifetime: the request
+// may succeed when retried after the lifetime in the response.
+static bool IsShortLifetimeError(uint8_t result_code) {
+  switch (result_code) {
+    case RC_NETWORK_FAILURE:
+    case RC_NO_RESOURCES:
+    case RC_USER_EX_QUOTA:
+    case RC_EXCESSIVE_REMOTE_PEERS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Matches up to RECV_BURST responses to pending mappings. Returns how many
+// of them were answered.
+static size_t HandleResps(struct Manager *mgr, const void *dgrams,
+                          size_t stride, const size_t lens[], size_t n) {
+  struct MapRespBatch batch = {
+    .valid = mgr->valid,
+    .result_code = mgr->result_code,
+    .lifetime = mgr->lifetime,
+    .epoch_time = mgr->epoch_time,
+    .mapping_nonce = mgr->mapping_nonce,
+    .internal_port = mgr->internal_port,
+    .external_port = mgr->external_port,
+    .external_ip = mgr->external_ip,
+  };
+  ReadMapRespBatch(dgrams, stride, lens, n, &batch);
+  size_t n_answered = 0;
+  for (size_t i = 0; i < n; ++i) {
+    size_t idx = (uint16_t)(batch.internal_port[i] - mgr->first_port);
+    if (!batch.valid[i] || idx >= mgr->n_mappings) continue;
+    struct Mapping *m = &mgr->mappings[idx];
+    if (!m->pending ||
+        memcmp(&m->nonce, &batch.mapping_nonce[i], sizeof(m->nonce)) != 0) {
+      continue;
+    }
+    // A late response to a renewal does not confirm a release.
+    if (mgr->requested_lifetime == 0 && batch.result_code[i] == RC_SUCCESS &&
+        batch.lifetime[i] != 0) {
+      continue;
+    }
+    m->pending = false;
+    --mgr->n_pending;
+    ++n_answered;
+    if (batch.result_code[i] != RC_SUCCESS) {
+      warnx("Port %" PRIu16 ": result_code=%" PRIu8,
+            batch.internal_port[i], batch.result_code[i]);
+      if (mgr->requested_lifetime == 0) continue;
+      if (IsShortLifetimeError(batch.result_code[i])) {
+        // An existing mapping is kept by the server until it expires.
+        uint64_t retry_ms = batch.lifetime[i] * 1000ULL;
+        if (retry_ms < RENEW_RETRY_MS) retry_ms = RENEW_RETRY_MS;
+        RenewSchedAt(mgr->sched, &m->renew, NowMs() + retry_ms);
+      } else {
+        m->mapped = false;
+        RenewSchedCancel(mgr->sched, &m->renew);
+      }
+      continue;
+    }
+    if (mgr->requested_lifetime == 0) m->requested = false;
+    m->lifetime = batch.lifetime[i];
+    m->external_port = batch.external_port[i];
+    m->external_ip = batch.external_ip[i];
+    m->mapped = m->lifetime != 0;
+    RenewSchedAdd(mgr->sched, &m->renew, m->lifetime);
+  }
+  return n_answered;
+}
+
+/*
+ * Sends a request with the given lifetime for every pending mapping. At most
+ * WINDOW requests are outstanding at a time, and a new request goes out as
+ * each response comes back. Unanswered requests are retransmitted in rounds
+ * until all are answered, the deadline passes or, if interruptible, a stop
+ * signal arrives.
+ */
+static void Exchange(struct Manager *mgr, uint32_t lifetime, uint64_t deadline,
+                     bool interruptible) {
+  size_t next = 0, in_flight = 0;
+  mgr->requested_lifetime = lifetime;
+  while (mgr->n_pending > 0 && !(interruptible && stop_requested)) {
+    uint64_t now = NowMs();
+    if (now >= deadline) break;
+    if (next == mgr->n_mappings && in_flight == 0) next = 0;
+
+    struct ReqFields fields[WINDOW];
+    size_t n_fields = 0;
+    for (; next < mgr->n_mappings && in_flight + n_fields < WINDOW; ++next) {
+      struct Mapping *m = &mgr->mappings[next];
+      if (!m->pending) continue;
+      if (lifetime != 0) m->requested = true;
+      fields[n_fields++] = (struct ReqFields){
+        .mapping_nonce = m->nonce,
+        .requested_lifetime = lifetime,
+        .internal_port = mgr->first_port + next,
+        .external_port = mgr->first_port + next,
+      };
+    }
+    if (n_fields > 0) SendReqs(mgr, fields, n_fields);
+    in_flight += n_fields;
+
+    int timeout_ms = deadline - now < RTO_MS ? (int)(deadline - now) : RTO_MS;
+    size_t n = RecvResps(mgr, timeout_ms);
+    if (n == 0) {
+      in_flight = 0;
+      continue;
+    }
+    size_t n_answered = HandleResps(mgr, mgr->in, RECV_BUF_LEN, mgr->in_lens,
+        n);
+    in_flight = n_answered < in_flight ? in_flight - n_answered : 0;
+  }
+}
+
+static void MarkDue(struct RenewEntry *entry, void *arg) {
+  struct Manager *mgr = arg;
+  struct Mapping *m = (struct Mapping *)entry;
+  m->pending = true;
+  ++mgr->n_pending;
+}
+
+static size_t CountMapped(const struct Manager *mgr) {
+  size_t n = 0;
+  for (size_t i = 0; i < mgr->n_mappings; ++i) n += mgr->mappings[i].mapped;
+  return n;
+}
+
+static void PrintMappings(const struct Manager *mgr) {
+  for (size_t i = 0; i < mgr->n_mappings; ++i) {
+    const struct Mapping *m = &mgr->mappings[i];
+    if (!m->mapped) continue;
+    char str[INET6_ADDRSTRLEN];
+    printf("Port %zu: external %s port %" PRIu16 ", lifetime %" PRIu32 "\n",
+           mgr->first_port + i, FormatAddr(&m->external_ip, str, sizeof(str)),
+           m->external_port, m->lifetime);
+  }
+  printf("Mapped %zu of %zu ports\n", CountMapped(mgr), mgr->n_mappings);
+}
+
+static size_t CountRequested(const struct Manager *mgr) {
+  size_t n = 0;
+  for (size_t i = 0; i < mgr->n_mappings; ++i) n += mgr->mappings[i].requested;
+  return n;
+}
+
+/*
+ * Deletes, with lifetime-0 requests within RELEASE_DEADLINE_MS, every mapping
+ * that was ever requested, including those whose creation was never
+ * confirmed. Deleting a mapping the server does not hold is harmless.
+ */
+static void ReleaseAll(struct Manager *mgr) {
+  uint64_t start = NowMs();
+  size_t n_requested = 0;
+  for (size_t i = 0; i < mgr->n_mappings; ++i) {
+    struct Mapping *m = &mgr->mappings[i];
+    m->pending = m->requested;
+    n_requested += m->requested;
+  }
+  mgr->n_pending = n_requested;
+  Exchange(mgr, 0, start + RELEASE_DEADLINE_MS, false);
+  printf("Released %zu of %zu mappings in %" PRIu64 " ms\n",
+         n_requested - CountRequested(mgr), n_requested, NowMs() - start);
+}
+
+static void KeepRenewed(struct Manager *mgr, uint32_t lifetime) {
+  unsigned char buf[RECV_BUF_LEN];
+  while (!stop_requested) {
+    RenewSchedAdvance(mgr->sched, NowMs(), MarkDue, mgr);
+    if (mgr->n_pending == 0) {
+      // Late responses to requests that were already retransmitted.
+      DgramRecv(mgr->io, buf, sizeof(buf), IDLE_WAIT_MS);
+      continue;
+    }
+    size_t n_due = mgr->n_pending;
+    Exchange(mgr, lifetime, NowMs() + MAP_DEADLINE_MS, true);
+    printf("Renewed %zu of %zu mappings\n", n_due - mgr->n_pending, n_due);
+    for (size_t i = 0; i < mgr->n_mappings && mgr->n_pending > 0; ++i) {
+      struct Mapping *m = &mgr->mappings[i];
+      if (m->pending) {
+        m->pending = false;
+        --mgr->n_pending;
+        RenewSchedAt(mgr->sched, &m->renew, NowMs() + RENEW_RETRY_MS);
+      }
+    }
+  }
+}
+
+// Tracks a mapping for every port in the configured range.
+struct Manager *NewManager(struct DgramIo *io,
+                           const struct ClientConfig *config) {
+  struct Manager *mgr = calloc(1, sizeof(*mgr));
+  if (mgr == NULL) err(EXIT_FAILURE, "Failed to allocate mapping manager");
+  mgr->io = io;
+  mgr->first_port = config->first_port;
+  mgr->n_mappings = (size_t)config->last_port - config->first_port + 1;
+  mgr->mappings = calloc(mgr->n_mappings, sizeof(*mgr->mappings));
+  mgr->sched = malloc(sizeof(*mgr->sched));
+  if (mgr->mappings == NULL || mgr->sched == NULL) {
+    err(EXIT_FAILURE, "Failed to allocate mapping manager");
+  }
+  RenewSchedInit(mgr->sched, NowMs());
+  InitTemplate(mgr, config);
+  return mgr;
+}
+
+void FreeManager(struct Manager *mgr) {
+  free(mgr->sched);
+  free(mgr->mappings);
+  free(mgr);
+}
+
+// Marks the mapping of port as awaiting a response to a request that was
+// sent outside of the manager, as when replaying a trace.
+void ManagerExpect(struct Manager *mgr, uint16_t port,
+                   const struct Nonce *nonce, uint32_t lifetime) {
+  size_t idx = (uint16_t)(port - mgr->first_port);
+  if (idx >= mgr->n_mappings) return;
+  struct Mapping *m = &mgr->mappings[idx];
+  m->nonce = *nonce;
+  if (lifetime != 0) m->requested = true;
+  if (!m->pending) {
+    m->pending = true;
+    ++mgr->n_pending;
+  }
+  mgr->requested_lifetime = lifetime;
+}
+
+// Feeds received datagrams to the manager. Returns how many of them answered
+// a pending request.
+size_t ManagerHandleResps(struct Manager *mgr, const void *dgrams,
+                          size_t stride, const size_t lens[], size_t n) {
+  const unsigned char *p = dgrams;
+  size_t n_answered = 0;
+  for (size_t i = 0; i < n; i += RECV_BURST) {
+    size_t chunk = n - i < RECV_BURST ? n - i : RECV_BURST;
+    n_answered += HandleResps(mgr, p + i * stride, stride, lens + i, chunk);
+  }
+  return n_answered;
+}
+
+/*
+ * Maps every port in the configured range. In keep mode, the mappings are
+ * renewed as their lifetimes run out until SIGTERM or SIGINT, and then all of
+ * them are released so that a standby can claim the ports.
+ */
+int RunManager(struct DgramIo *io, const struct ClientConfig *config) {
+  struct Manager *mgr = NewManager(io, config);
+  if (config->keep) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnStopSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+  }
+
+  for (size_t i = 0; i < mgr->n_mappings; ++i) {
+    NonceInit(&mgr->mappings[i].nonce);
+    mgr->mappings[i].pending = true;
+  }
+  mgr->n_pending = mgr->n_mappings;
+  Exchange(mgr, config->lifetime, NowMs() + MAP_DEADLINE_MS, config->keep);
+  PrintMappings(mgr);
+
+  if (config->keep) {
+    KeepRenewed(mgr, config->lifetime);
+    ReleaseAll(mgr);
+  }
+
+  FreeManager(mgr);
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef PCP_MANAGER_H
+#define PCP_MANAGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "client.h"
+#include "dgram.h"
+#include "message.h"
+
+struct Manager;
+
+struct Manager *NewManager(struct DgramIo *io,
+                           const struct ClientConfig *config);
+void FreeManager(struct Manager *mgr);
+void ManagerExpect(struct Manager *mgr, uint16_t port,
+                   const struct Nonce *nonce, uint32_t lifetime);
+size_t ManagerHandleResps(struct Manager *mgr, const void *dgrams,
+                          size_t stride, const size_t lens[], size_t n);
+
+int RunManager(struct DgramIo *io, const struct ClientConfig *config);
+
+#endif
@@ -2,6 +2,13 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "buffer.h"
 
@@ -79,6 +86,56 @@ void *WriteOption(const struct OptionHdr *option, void *buf, size_t max_len) {
   return buf;
 }
 
+// Offsets of the fields shared by MAP and PEER requests and responses.
+#define OFF_LIFETIME 4U
+#define OFF_NONCE LEN_MSG_HDR
+#define OFF_PORTS (LEN_MSG_HDR + 16U)
+
+bool ReqTemplateInit(struct ReqTemplate *tmpl, const struct ReqHdr *req,
+                     const void *opcode_info,
+                     const struct OptionHdr *const options[],
+                     size_t n_options) {
+  unsigned char *cur = WriteReqHdr(req, tmpl->buf, sizeof(tmpl->buf));
+  switch (req->opcode) {
+    case OPCODE_MAP:
+      cur = WriteMapInfo(opcode_info, cur,
+          sizeof(tmpl->buf) - (cur - tmpl->buf));
+      break;
+    case OPCODE_PEER:
+      cur = WritePeerInfo(opcode_info, cur,
+          sizeof(tmpl->buf) - (cur - tmpl->buf));
+      break;
+    default:
+      return false;
+  }
+  for (size_t i = 0; i < n_options && cur != NULL; ++i) {
+    cur = WriteOption(options[i], cur, sizeof(tmpl->buf) - (cur - tmpl->buf));
+  }
+  if (cur == NULL) return false;
+  tmpl->len = cur - tmpl->buf;
+  return true;
+}
+
+size_t WriteReqBatch(const struct ReqTemplate *tmpl,
+                     const struct ReqFields fields[], size_t n,
+                     void *out, size_t stride) {
+  if (stride < tmpl->len) return 0;
+  unsigned char *dgram = out;
+  for (size_t i = 0; i < n; ++i, dgram += stride) {
+    // Fixed-size stores only: the compiler lowers these to wide moves
+    // without per-byte shifting or branching.
+    uint32_t lifetime = htonl(fields[i].requested_lifetime);
+    uint32_t ports = htonl((uint32_t)fields[i].internal_port << 16 |
+                           fields[i].external_port);
+    memcpy(dgram, tmpl->buf, tmpl->len);
+    memcpy(dgram + OFF_LIFETIME, &lifetime, sizeof(lifetime));
+    memcpy(dgram + OFF_NONCE, fields[i].mapping_nonce.n,
+           sizeof(fields[i].mapping_nonce.n));
+    memcpy(dgram + OFF_PORTS, &ports, sizeof(ports));
+  }
+  return n;
+}
+
 const void *ReadRespHdr(const void *buf, size_t len, struct RespHdr *resp) {
   if (len < LEN_MSG_HDR) return NULL;
   buf = BufReadByte(buf, &resp->version);
@@ -112,7 +169,7 @@ const void *ReadOption(const void *buf, size_t len, struct OptionHdr *option) {
   switch (option->code) {
     case OPTION_THIRD_PARTY: {
       if (option->length != LEN_OPTION_BODY_THIRD_PARTY) return NULL;
-      struct ThirdPartyOption *third = (struct ThirdPartyOption *)buf;
+      struct ThirdPartyOption *third = (struct ThirdPartyOption *)option;
       buf = BufReadBytes(buf, &third->internal_ip, sizeof(third->internal_ip));
       break;
     }
@@ -122,7 +179,7 @@ const void *ReadOption(const void *buf, size_t len, struct OptionHdr *option) {
     }
     case OPTION_FILTER: {
       if (option->length != LEN_OPTION_BODY_FILTER) return NULL;
-      struct FilterOption *filter = (struct FilterOption *)buf;
+      struct FilterOption *filter = (struct FilterOption *)option;
       buf = BufReadIgnore(buf, 1);
       buf = BufReadByte(buf, &filter->prefix_length);
       buf = BufReadNetU16(buf, &filter->peer_port);
@@ -136,3 +193,71 @@ const void *ReadOption(const void *buf, size_t len, struct OptionHdr *option) {
   }
   return buf;
 }
+
+// Number of datagrams whose header words are validated together.
+#define RESP_CHUNK 64U
+
+static uint32_t LoadNetU32(const unsigned char *p) {
+  uint32_t u32;
+  memcpy(&u32, p, sizeof(u32));
+  return ntohl(u32);
+}
+
+// Clears valid[i] unless the version, R bit and opcode in words[i] are those
+// of a PCP MAP response.
+static void ValidateMapRespWords(const uint32_t words[], uint8_t valid[],
+                                 size_t n) {
+  const uint32_t mask = 0xffff0000U;
+  const uint32_t expected = (uint32_t)PCP_VERSION << 24 |
+                            (uint32_t)(0x80 | OPCODE_MAP) << 16;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i vmask = _mm_set1_epi32(mask);
+  const __m128i vexpected = _mm_set1_epi32(expected);
+  for (; i + 4 <= n; i += 4) {
+    __m128i w = _mm_loadu_si128((const __m128i *)(words + i));
+    int eq = _mm_movemask_ps(_mm_castsi128_ps(
+        _mm_cmpeq_epi32(_mm_and_si128(w, vmask), vexpected)));
+    valid[i] &= eq & 1;
+    valid[i + 1] &= eq >> 1 & 1;
+    valid[i + 2] &= eq >> 2 & 1;
+    valid[i + 3] &= eq >> 3 & 1;
+  }
+#endif
+  for (; i < n; ++i) {
+    valid[i] &= (words[i] & mask) == expected;
+  }
+}
+
+size_t ReadMapRespBatch(const void *dgrams, size_t stride, const size_t lens[],
+                        size_t n, struct MapRespBatch *out) {
+  if (stride < LEN_MSG_HDR + LEN_MAP_INFO) return 0;
+  const unsigned char *base = dgrams;
+  size_t n_valid = 0;
+  for (size_t begin = 0; begin < n; begin += RESP_CHUNK) {
+    size_t end = n - begin < RESP_CHUNK ? n : begin + RESP_CHUNK;
+    uint32_t words[RESP_CHUNK];
+    for (size_t i = begin; i < end; ++i) {
+      words[i - begin] = LoadNetU32(base + i * stride);
+      out->valid[i] = (lens[i] & 0x3) == 0 &&
+                      lens[i] >= LEN_MSG_HDR + LEN_MAP_INFO &&
+                      lens[i] <= LEN_MAX_PAYLOAD;
+    }
+    ValidateMapRespWords(words, out->valid + begin, end - begin);
+    for (size_t i = begin; i < end; ++i) {
+      const unsigned char *p = base + i * stride;
+      uint32_t ports = LoadNetU32(p + OFF_PORTS);
+      out->result_code[i] = words[i - begin] & 0xff;
+      out->lifetime[i] = LoadNetU32(p + OFF_LIFETIME);
+      out->epoch_time[i] = LoadNetU32(p + OFF_LIFETIME + 4);
+      memcpy(out->mapping_nonce[i].n, p + OFF_NONCE,
+             sizeof(out->mapping_nonce[i].n));
+      out->internal_port[i] = ports >> 16;
+      out->external_port[i] = ports & 0xffff;
+      memcpy(&out->external_ip[i], p + OFF_PORTS + 4,
+             sizeof(out->external_ip[i]));
+      n_valid += out->valid[i];
+    }
+  }
+  return n_valid;
+}
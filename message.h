@@ -2,6 +2,7 @@
 #define PCP_MESSAGE_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -235,6 +236,40 @@ struct FilterOption {
   struct in6_addr peer_ip;
 };
 
+/*
+ * Pre-serialized MAP or PEER request. Everything except the requested
+ * lifetime, mapping nonce and ports is identical across a bulk run, so it is
+ * encoded once and only the per-request fields are stamped into each copy.
+ */
+struct ReqTemplate {
+  unsigned char buf[LEN_MAX_PAYLOAD];
+  size_t len;
+};
+
+// Per-request fields stamped into a ReqTemplate by WriteReqBatch().
+struct ReqFields {
+  struct Nonce mapping_nonce;
+  uint32_t requested_lifetime;
+  uint16_t internal_port;
+  uint16_t external_port;
+};
+
+/*
+ * Decoded MAP responses in structure-of-arrays form: entry i of every column
+ * belongs to the i-th datagram passed to ReadMapRespBatch(). Fields of an
+ * entry whose valid flag is 0 are unspecified.
+ */
+struct MapRespBatch {
+  uint8_t *valid;
+  uint8_t *result_code;
+  uint32_t *lifetime;
+  uint32_t *epoch_time;
+  struct Nonce *mapping_nonce;
+  uint16_t *internal_port;
+  uint16_t *external_port;
+  struct in6_addr *external_ip;
+};
+
 void NonceInit(struct Nonce *nonce);
 
 void *WriteReqHdr(const struct ReqHdr *req, void *buf, size_t max_len);
@@ -242,8 +277,19 @@ void *WriteMapInfo(const struct MapInfo *info, void *buf, size_t max_len);
 void *WritePeerInfo(const struct PeerInfo *info, void *buf, size_t max_len);
 void *WriteOption(const struct OptionHdr *option, void *buf, size_t max_len);
 
+bool ReqTemplateInit(struct ReqTemplate *tmpl, const struct ReqHdr *req,
+                     const void *opcode_info,
+                     const struct OptionHdr *const options[],
+                     size_t n_options);
+size_t WriteReqBatch(const struct ReqTemplate *tmpl,
+                     const struct ReqFields fields[], size_t n,
+                     void *out, size_t stride);
+
 const void *ReadRespHdr(const void *buf, size_t len, struct RespHdr *resp);
 const void *ReadMapInfo(const void *buf, size_t len, struct MapInfo *info);
 const void *ReadOption(const void *buf, size_t len, struct OptionHdr *option);
 
+size_t ReadMapRespBatch(const void *dgrams, size_t stride, const size_t lens[],
+                        size_t n, struct MapRespBatch *out);
+
 #endif
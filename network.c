@@ -1,6 +1,7 @@
 #include "network.h"
 
 #include <assert.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
 #include <string.h>
 
@@ -54,3 +55,12 @@ struct in6_addr SuggestedExternalAddr(const struct sockaddr *addr) {
       return in6addr_any;
   }
 }
+
+// Formats IPv4-mapped addresses in dotted-decimal notation.
+const char *FormatAddr(const struct in6_addr *addr, char *str, size_t len) {
+  if (IN6_IS_ADDR_V4MAPPED(addr)) {
+    struct in_addr ipv4 = Map6To4(*addr);
+    return inet_ntop(AF_INET, &ipv4, str, len);
+  }
+  return inet_ntop(AF_INET6, addr, str, len);
+}
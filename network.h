@@ -1,6 +1,7 @@
 #ifndef PCP_NETWORK_H
 #define PCP_NETWORK_H
 
+#include <stddef.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -12,4 +13,6 @@ struct in6_addr FixedSizeAddr(const struct sockaddr *addr);
 
 struct in6_addr SuggestedExternalAddr(const struct sockaddr *addr);
 
+const char *FormatAddr(const struct in6_addr *addr, char *str, size_t len);
+
 #endif
@@ -0,0 +1,179 @@
+#include "renew.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_MASK (RENEW_SLOTS - 1U)
+#define HORIZON (1ULL << (RENEW_SLOT_BITS * RENEW_LEVELS))
+#define LOAD_NONE UINT32_MAX
+
+// xorshift64*, good enough to spread renewals and much cheaper than
+// arc4random() for a million mappings.
+static uint64_t NextRand(struct RenewSched *sched) {
+  sched->rng ^= sched->rng >> 12;
+  sched->rng ^= sched->rng << 25;
+  sched->rng ^= sched->rng >> 27;
+  return sched->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static void Unlink(struct RenewSched *sched, struct RenewEntry *entry) {
+  --sched->level_count[entry->level];
+  if (entry->next != NULL) entry->next->pprev = entry->pprev;
+  *entry->pprev = entry->next;
+  entry->next = NULL;
+  entry->pprev = NULL;
+}
+
+// Links entry into the wheel slot that is visited first at or after its
+// deadline. Deadlines past the horizon are visited early and placed again.
+static void Place(struct RenewSched *sched, struct RenewEntry *entry) {
+  uint64_t base = sched->now + 1;
+  uint64_t expires = entry->deadline > base ? entry->deadline : base;
+  uint64_t delta = expires - base;
+  if (delta >= HORIZON) {
+    expires = base + HORIZON - 1;
+    delta = HORIZON - 1;
+  }
+  unsigned level = 0;
+  while (level + 1 < RENEW_LEVELS &&
+         delta >= 1ULL << (RENEW_SLOT_BITS * (level + 1))) {
+    ++level;
+  }
+  unsigned slot = (expires >> (RENEW_SLOT_BITS * level)) & SLOT_MASK;
+  struct RenewEntry **head = &sched->wheel[level][slot];
+  entry->level = level;
+  ++sched->level_count[level];
+  entry->next = *head;
+  if (entry->next != NULL) entry->next->pprev = &entry->next;
+  entry->pprev = head;
+  *head = entry;
+}
+
+static uint32_t LoadSec(const struct RenewSched *sched, uint64_t deadline) {
+  uint64_t sec = deadline / 1000;
+  if (deadline < sched->now || sec - sched->now / 1000 >= RENEW_LOAD_SECS) {
+    return LOAD_NONE;
+  }
+  return sec % RENEW_LOAD_SECS;
+}
+
+static uint32_t LoadAt(const struct RenewSched *sched, uint64_t deadline) {
+  uint32_t sec = LoadSec(sched, deadline);
+  return sec == LOAD_NONE ? 0 : sched->load[sec];
+}
+
+static void Remove(struct RenewSched *sched, struct RenewEntry *entry) {
+  Unlink(sched, entry);
+  if (entry->load_sec != LOAD_NONE) --sched->load[entry->load_sec];
+  --sched->count;
+}
+
+void RenewSchedInit(struct RenewSched *sched, uint64_t now) {
+  memset(sched, 0, sizeof(*sched));
+  sched->now = now;
+  do {
+    arc4random_buf(&sched->rng, sizeof(sched->rng));
+  } while (sched->rng == 0);
+}
+
+void RenewSchedAt(struct RenewSched *sched, struct RenewEntry *entry,
+                  uint64_t deadline) {
+  if (entry->pprev != NULL) Remove(sched, entry);
+  entry->deadline = deadline;
+  entry->load_sec = LoadSec(sched, deadline);
+  if (entry->load_sec != LOAD_NONE) ++sched->load[entry->load_sec];
+  ++sched->count;
+  Place(sched, entry);
+}
+
+/*
+ * Schedules the renewal of a mapping granted for lifetime seconds, replacing
+ * any earlier schedule. As recommended by RFC 6887 section 11.2.1, the
+ * renewal falls at a random time between 1/2 and 5/8 of the lifetime; of two
+ * random candidates, the one whose second carries fewer renewals is taken so
+ * that renewal traffic stays flat. A lifetime of 0 cancels the renewal.
+ */
+uint64_t RenewSchedAdd(struct RenewSched *sched, struct RenewEntry *entry,
+                       uint32_t lifetime) {
+  if (lifetime == 0) {
+    RenewSchedCancel(sched, entry);
+    return 0;
+  }
+  uint64_t lo = sched->now + lifetime * 500ULL;
+  uint64_t range = lifetime * 125ULL + 1;
+  uint64_t a = lo + NextRand(sched) % range;
+  uint64_t b = lo + NextRand(sched) % range;
+  uint64_t deadline = LoadAt(sched, b) < LoadAt(sched, a) ? b : a;
+  RenewSchedAt(sched, entry, deadline);
+  return deadline;
+}
+
+void RenewSchedCancel(struct RenewSched *sched, struct RenewEntry *entry) {
+  if (entry->pprev != NULL) Remove(sched, entry);
+}
+
+static void Cascade(struct RenewSched *sched, unsigned level, unsigned slot) {
+  struct RenewEntry *entry = sched->wheel[level][slot];
+  sched->wheel[level][slot] = NULL;
+  while (entry != NULL) {
+    struct RenewEntry *next = entry->next;
+    --sched->level_count[level];
+    Place(sched, entry);
+    entry = next;
+  }
+}
+
+/*
+ * Moves the clock forward to now, calling due for every entry whose deadline
+ * has been reached, in deadline order. Returns the number of due entries.
+ * The callback may add, reschedule or cancel entries.
+ */
+size_t RenewSchedAdvance(struct RenewSched *sched, uint64_t now,
+                         RenewDueFn due, void *arg) {
+  size_t n_due = 0;
+  while (sched->now < now) {
+    if (sched->count == 0) {
+      sched->now = now;
+      break;
+    }
+    if (sched->level_count[0] == 0) {
+      // Nothing can be due before the next cascade of the lowest occupied
+      // level, so jump to the tick before it.
+      unsigned level = 1;
+      while (sched->level_count[level] == 0) ++level;
+      uint64_t span = 1ULL << (RENEW_SLOT_BITS * level);
+      uint64_t next = (sched->now / span + 1) * span;
+      if (next - 1 > sched->now) {
+        sched->now = next - 1 < now ? next - 1 : now;
+        continue;
+      }
+    }
+    uint64_t tick = sched->now + 1;
+    for (unsigned level = RENEW_LEVELS - 1; level > 0; --level) {
+      uint64_t span = 1ULL << (RENEW_SLOT_BITS * level);
+      if ((tick & (span - 1)) == 0) {
+        unsigned slot = (tick >> (RENEW_SLOT_BITS * level)) & SLOT_MASK;
+        Cascade(sched, level, slot);
+      }
+    }
+    sched->now = tick;
+    // Drain a detached list so that entries the callback places into this
+    // slot wait until the next time around. The callback may still cancel
+    // entries on it, which unlinks them from the local head.
+    struct RenewEntry *list = sched->wheel[0][tick & SLOT_MASK];
+    sched->wheel[0][tick & SLOT_MASK] = NULL;
+    if (list != NULL) list->pprev = &list;
+    while (list != NULL) {
+      struct RenewEntry *entry = list;
+      if (entry->deadline > tick) {
+        Unlink(sched, entry);
+        Place(sched, entry);
+        continue;
+      }
+      Remove(sched, entry);
+      ++n_due;
+      due(entry, arg);
+    }
+  }
+  return n_due;
+}
@@ -0,0 +1,50 @@
+#ifndef PCP_RENEW_H
+#define PCP_RENEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Timing wheel geometry: 4 levels of 256 slots with 1 ms ticks.
+#define RENEW_LEVELS 4U
+#define RENEW_SLOT_BITS 8U
+#define RENEW_SLOTS (1U << RENEW_SLOT_BITS)
+// Seconds of renewal load tracked for smoothing.
+#define RENEW_LOAD_SECS 65536U
+
+/*
+ * A mapping tracked by a RenewSched, embedded in the caller's mapping record.
+ * It must be zero-initialized before its first use.
+ */
+struct RenewEntry {
+  struct RenewEntry *next, **pprev;
+  uint64_t deadline;
+  uint32_t load_sec;
+  uint8_t level;
+};
+
+/*
+ * Deadline-ordered renewal queue implemented as a hierarchical timing wheel.
+ * Adding, rescheduling and cancelling an entry are O(1); time is in
+ * milliseconds on a caller-chosen monotonic clock.
+ */
+struct RenewSched {
+  uint64_t now;
+  size_t count;
+  size_t level_count[RENEW_LEVELS];
+  uint64_t rng;
+  struct RenewEntry *wheel[RENEW_LEVELS][RENEW_SLOTS];
+  uint32_t load[RENEW_LOAD_SECS];
+};
+
+typedef void (*RenewDueFn)(struct RenewEntry *entry, void *arg);
+
+void RenewSchedInit(struct RenewSched *sched, uint64_t now);
+uint64_t RenewSchedAdd(struct RenewSched *sched, struct RenewEntry *entry,
+                       uint32_t lifetime);
+void RenewSchedAt(struct RenewSched *sched, struct RenewEntry *entry,
+                  uint64_t deadline);
+void RenewSchedCancel(struct RenewSched *sched, struct RenewEntry *entry);
+size_t RenewSchedAdvance(struct RenewSched *sched, uint64_t now,
+                         RenewDueFn due, void *arg);
+
+#endif
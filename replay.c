@@ -0,0 +1,253 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <err.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "client.h"
+#include "manager.h"
+#include "message.h"
+#include "trace.h"
+
+// Received datagrams handed to the manager together, as after a burst.
+#define BURST 64U
+#define BUF_LEN (LEN_MAX_PAYLOAD + 4U)
+
+struct ReplayStats {
+  size_t n_sent;
+  size_t n_recv;
+  size_t n_malformed;
+  size_t n_options;
+  size_t n_answered;
+  uint64_t *rtts;
+  size_t n_rtts;
+};
+
+// The exchange awaiting a response on one internal port.
+struct Outstanding {
+  struct Nonce nonce;
+  uint32_t lifetime;
+  // First transmission of the request; 0 when none is outstanding.
+  uint64_t sent_ns;
+};
+
+struct Replay {
+  struct Manager *mgr;
+  unsigned char burst[BURST][BUF_LEN];
+  size_t lens[BURST];
+  size_t n_burst;
+  struct Outstanding outstanding[UINT16_MAX + 1];
+};
+
+static void usage(FILE* f) {
+  fprintf(f, "Usage:\n"
+      "\tpcpreplay [-n <rounds>] <trace_file>\n");
+}
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a recorded MAP request. Returns false for anything else.
+static bool ParseMapReq(const struct TraceRecord *rec, uint32_t *lifetime,
+                        struct MapInfo *info) {
+  uint8_t version, opcode;
+  if (rec->len < LEN_MSG_HDR + LEN_MAP_INFO) return false;
+  const void *cur = BufReadByte(rec->data, &version);
+  cur = BufReadByte(cur, &opcode);
+  cur = BufReadIgnore(cur, 2);
+  BufReadNetU32(cur, lifetime);
+  if (version != PCP_VERSION || opcode != OPCODE_MAP) return false;
+  return ReadMapInfo(rec->data + LEN_MSG_HDR, rec->len - LEN_MSG_HDR,
+                     info) != NULL;
+}
+
+// Runs a recorded response through the per-message parsers. Returns false if
+// it is malformed.
+static bool ParseMapResp(const struct TraceRecord *rec, struct RespHdr *hdr,
+                         struct MapInfo *info, size_t *n_options) {
+  if (rec->len > LEN_MAX_PAYLOAD || (rec->len & 0x3) != 0) return false;
+  const unsigned char *end = rec->data + rec->len;
+  const unsigned char *cur = ReadRespHdr(rec->data, rec->len, hdr);
+  if (cur == NULL || hdr->version != PCP_VERSION ||
+      hdr->r_opcode != (0x80 | OPCODE_MAP)) {
+    return false;
+  }
+  cur = ReadMapInfo(cur, end - cur, info);
+  while (cur != NULL && cur < end) {
+    struct FilterOption option;
+    cur = ReadOption(cur, end - cur, &option.hdr);
+    if (cur != NULL) ++*n_options;
+  }
+  return cur != NULL;
+}
+
+static void FlushBurst(struct Replay *replay, struct ReplayStats *stats) {
+  stats->n_answered += ManagerHandleResps(replay->mgr, replay->burst, BUF_LEN,
+      replay->lens, replay->n_burst);
+  replay->n_burst = 0;
+}
+
+// Feeds every record of the trace to the parsers and the mapping manager.
+static void ReplayOnce(struct TraceReader *tr, struct Replay *replay,
+                       struct ReplayStats *stats) {
+  struct TraceRecord rec;
+  TraceRewind(tr);
+  while (TraceNext(tr, &rec)) {
+    if (rec.kind == TRACE_SENT) {
+      uint32_t lifetime;
+      struct MapInfo info;
+      ++stats->n_sent;
+      if (!ParseMapReq(&rec, &lifetime, &info)) continue;
+      // Responses received so far must not match this request.
+      FlushBurst(replay, stats);
+      ManagerExpect(replay->mgr, info.internal_port, &info.mapping_nonce,
+          lifetime);
+      // Retransmissions keep the time of the first send.
+      struct Outstanding *o = &replay->outstanding[info.internal_port];
+      if (o->sent_ns == 0 || o->lifetime != lifetime ||
+          memcmp(&o->nonce, &info.mapping_nonce, sizeof(o->nonce)) != 0) {
+        o->nonce = info.mapping_nonce;
+        o->lifetime = lifetime;
+        o->sent_ns = rec.ts_ns;
+      }
+      continue;
+    }
+    if (rec.kind != TRACE_RECV) continue;
+
+    struct RespHdr hdr;
+    struct MapInfo info;
+    ++stats->n_recv;
+    if (!ParseMapResp(&rec, &hdr, &info, &stats->n_options)) {
+      ++stats->n_malformed;
+    } else {
+      struct Outstanding *o = &replay->outstanding[info.internal_port];
+      if (stats->rtts != NULL && o->sent_ns != 0 &&
+          memcmp(&o->nonce, &info.mapping_nonce, sizeof(o->nonce)) == 0) {
+        stats->rtts[stats->n_rtts++] = rec.ts_ns - o->sent_ns;
+        o->sent_ns = 0;
+      }
+    }
+    size_t len = rec.len < BUF_LEN ? rec.len : BUF_LEN;
+    memcpy(replay->burst[replay->n_burst], rec.data, len);
+    replay->lens[replay->n_burst++] = rec.len;
+    if (replay->n_burst == BURST) FlushBurst(replay, stats);
+  }
+  FlushBurst(replay, stats);
+}
+
+// Finds the range of internal ports requested in the trace.
+static size_t ScanPorts(struct TraceReader *tr, uint16_t *first,
+                        uint16_t *last, uint64_t *span_ns) {
+  struct TraceRecord rec;
+  uint64_t first_ns = 0, last_ns = 0;
+  size_t n_records = 0;
+  *first = UINT16_MAX;
+  *last = 0;
+  TraceRewind(tr);
+  while (TraceNext(tr, &rec)) {
+    if (n_records++ == 0) first_ns = rec.ts_ns;
+    last_ns = rec.ts_ns;
+    uint32_t lifetime;
+    struct MapInfo info;
+    if (rec.kind != TRACE_SENT || !ParseMapReq(&rec, &lifetime, &info)) {
+      continue;
+    }
+    if (info.internal_port < *first) *first = info.internal_port;
+    if (info.internal_port > *last) *last = info.internal_port;
+  }
+  *span_ns = last_ns - first_ns;
+  return n_records;
+}
+
+static int CompareU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void PrintRtts(uint64_t *rtts, size_t n) {
+  if (n == 0) return;
+  qsort(rtts, n, sizeof(*rtts), CompareU64);
+  printf("Response time (ms): p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+         rtts[n / 2] / 1e6, rtts[n * 9 / 10] / 1e6, rtts[n * 99 / 100] / 1e6,
+         rtts[n - 1] / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned rounds = 1;
+  int ch;
+  while ((ch = getopt(argc, argv, "n:h")) != -1) {
+    switch (ch) {
+      case 'n':
+        rounds = atoi(optarg);
+        break;
+      case 'h':
+        usage(stdout);
+        exit(EXIT_SUCCESS);
+      case '?':
+      default:
+        usage(stderr);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind + 1 != argc || rounds == 0) {
+    usage(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  struct TraceReader tr;
+  if (TraceReaderOpen(&tr, argv[optind]) == -1) {
+    err(EXIT_FAILURE, "Failed to open trace file %s", argv[optind]);
+  }
+  uint16_t first_port, last_port;
+  uint64_t span_ns;
+  size_t n_records = ScanPorts(&tr, &first_port, &last_port, &span_ns);
+  if (first_port > last_port) errx(EXIT_FAILURE, "No MAP requests in trace");
+
+  // Only the port range matters; requests are replayed from the trace.
+  struct sockaddr_in any = { .sin_family = AF_INET };
+  struct ClientConfig config = {
+    .client_addr = (const struct sockaddr *)&any,
+    .sa_len = sizeof(any),
+    .protocol = IPPROTO_TCP,
+    .first_port = first_port,
+    .last_port = last_port,
+  };
+  struct Replay *replay = calloc(1, sizeof(*replay));
+  struct ReplayStats stats = {
+    .rtts = calloc(n_records, sizeof(*stats.rtts)),
+  };
+  if (replay == NULL || stats.rtts == NULL) err(EXIT_FAILURE, "malloc");
+  replay->mgr = NewManager(NULL, &config);
+
+  ReplayOnce(&tr, replay, &stats);
+  printf("Records: %zu over %.3f s\n"
+         "Requests: %zu\n"
+         "Responses: %zu (%zu malformed, %zu options)\n"
+         "Answered: %zu\n",
+         n_records, span_ns / 1e9, stats.n_sent, stats.n_recv,
+         stats.n_malformed, stats.n_options, stats.n_answered);
+  PrintRtts(stats.rtts, stats.n_rtts);
+
+  // Further rounds only measure how fast the trace is processed.
+  free(stats.rtts);
+  stats.rtts = NULL;
+  double start = Now();
+  for (unsigned i = 1; i < rounds; ++i) ReplayOnce(&tr, replay, &stats);
+  if (rounds > 1) {
+    printf("Replay: %.0f records/s\n",
+           n_records * (rounds - 1) / (Now() - start));
+  }
+
+  FreeManager(replay->mgr);
+  free(replay);
+  TraceReaderClose(&tr);
+  return 0;
+}
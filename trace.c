@@ -0,0 +1,155 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define REC_ALIGN 16U
+
+static uint64_t RecSize(size_t len) {
+  size_t padded = (len + REC_ALIGN - 1) & ~(size_t)(REC_ALIGN - 1);
+  return sizeof(struct TraceRecHdr) + padded;
+}
+
+// Size of the record at logical offset pos, including trailing padding.
+static uint64_t RecSizeAt(const struct TraceFileHdr *hdr,
+                          const unsigned char *data, uint64_t pos) {
+  uint64_t phys = pos % hdr->capacity;
+  const struct TraceRecHdr *rec = (const struct TraceRecHdr *)(data + phys);
+  return rec->kind == TRACE_WRAP ? hdr->capacity - phys : RecSize(rec->len);
+}
+
+int TraceWriterOpen(struct TraceWriter *tw, const char *path,
+                    uint64_t capacity) {
+  capacity &= ~(uint64_t)(REC_ALIGN - 1);
+  if (capacity < TRACE_MIN_CAPACITY) {
+    errno = EINVAL;
+    return -1;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return -1;
+  tw->map_len = TRACE_DATA_OFFSET + capacity;
+  if (ftruncate(fd, tw->map_len) == -1) {
+    close(fd);
+    return -1;
+  }
+  tw->map = mmap(NULL, tw->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (tw->map == MAP_FAILED) return -1;
+  tw->hdr = (struct TraceFileHdr *)tw->map;
+  tw->data = tw->map + TRACE_DATA_OFFSET;
+  memcpy(tw->hdr->magic, TRACE_MAGIC, sizeof(tw->hdr->magic));
+  tw->hdr->version = TRACE_VERSION;
+  tw->hdr->capacity = capacity;
+  tw->hdr->head = 0;
+  tw->hdr->tail = 0;
+  return 0;
+}
+
+// Drops the oldest records until size more bytes fit into the ring.
+static void Reserve(struct TraceWriter *tw, uint64_t size) {
+  struct TraceFileHdr *hdr = tw->hdr;
+  while (hdr->head + size - hdr->tail > hdr->capacity) {
+    hdr->tail += RecSizeAt(hdr, tw->data, hdr->tail);
+  }
+}
+
+void TraceAppend(struct TraceWriter *tw, enum TraceKind kind,
+                 const void *buf, size_t len) {
+  struct TraceFileHdr *hdr = tw->hdr;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (len > UINT16_MAX) len = UINT16_MAX;
+  uint64_t size = RecSize(len);
+
+  uint64_t room = hdr->capacity - hdr->head % hdr->capacity;
+  if (room < size) {
+    Reserve(tw, room);
+    struct TraceRecHdr *wrap =
+        (struct TraceRecHdr *)(tw->data + hdr->head % hdr->capacity);
+    memset(wrap, 0, sizeof(*wrap));
+    wrap->kind = TRACE_WRAP;
+    hdr->head += room;
+  }
+  Reserve(tw, size);
+  struct TraceRecHdr *rec =
+      (struct TraceRecHdr *)(tw->data + hdr->head % hdr->capacity);
+  rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec->len = len;
+  rec->kind = kind;
+  memset(rec->reserved, 0, sizeof(rec->reserved));
+  memcpy(rec + 1, buf, len);
+  hdr->head += size;
+}
+
+void TraceWriterClose(struct TraceWriter *tw) {
+  munmap(tw->map, tw->map_len);
+  tw->map = NULL;
+}
+
+int TraceReaderOpen(struct TraceReader *tr, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < TRACE_DATA_OFFSET) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  tr->map_len = st.st_size;
+  tr->map = mmap(NULL, tr->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (tr->map == MAP_FAILED) return -1;
+  tr->hdr = (const struct TraceFileHdr *)tr->map;
+  tr->data = tr->map + TRACE_DATA_OFFSET;
+  if (memcmp(tr->hdr->magic, TRACE_MAGIC, sizeof(tr->hdr->magic)) != 0 ||
+      tr->hdr->version != TRACE_VERSION ||
+      tr->hdr->capacity > tr->map_len - TRACE_DATA_OFFSET ||
+      tr->hdr->capacity < TRACE_MIN_CAPACITY ||
+      tr->hdr->capacity % REC_ALIGN != 0 ||
+      tr->hdr->head - tr->hdr->tail > tr->hdr->capacity) {
+    munmap(tr->map, tr->map_len);
+    errno = EINVAL;
+    return -1;
+  }
+  TraceRewind(tr);
+  return 0;
+}
+
+bool TraceNext(struct TraceReader *tr, struct TraceRecord *rec) {
+  const struct TraceFileHdr *hdr = tr->hdr;
+  while (tr->pos < hdr->head) {
+    uint64_t phys = tr->pos % hdr->capacity;
+    const struct TraceRecHdr *rec_hdr =
+        (const struct TraceRecHdr *)(tr->data + phys);
+    uint64_t size = RecSizeAt(hdr, tr->data, tr->pos);
+    // A truncated record can only come from a damaged file.
+    if (size > hdr->capacity - phys) return false;
+    tr->pos += size;
+    if (rec_hdr->kind == TRACE_WRAP) continue;
+    rec->ts_ns = rec_hdr->ts_ns;
+    rec->kind = rec_hdr->kind;
+    rec->data = (const unsigned char *)(rec_hdr + 1);
+    rec->len = rec_hdr->len;
+    return true;
+  }
+  return false;
+}
+
+void TraceRewind(struct TraceReader *tr) {
+  tr->pos = tr->hdr->tail;
+}
+
+void TraceReaderClose(struct TraceReader *tr) {
+  munmap(tr->map, tr->map_len);
+  tr->map = NULL;
+}
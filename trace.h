@@ -0,0 +1,78 @@
+#ifndef PCP_TRACE_H
+#define PCP_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "PCPTRACE"
+#define TRACE_VERSION 1U
+#define TRACE_DATA_OFFSET 64U
+#define TRACE_MIN_CAPACITY (64U * 1024U)
+#define TRACE_DEFAULT_CAPACITY (64U * 1024U * 1024U)
+
+enum TraceKind {
+  TRACE_SENT = 1,
+  TRACE_RECV = 2,
+  // Padding up to the end of the ring.
+  TRACE_WRAP = 3,
+};
+
+/*
+ * A trace file is this header followed, at TRACE_DATA_OFFSET, by a ring of
+ * capacity bytes holding records between the logical offsets tail and head.
+ * Each record is a TraceRecHdr and len bytes of datagram, padded to 16 bytes;
+ * a record never straddles the end of the ring. Once the ring is full, the
+ * oldest records are overwritten. Integers are in host byte order.
+ */
+struct TraceFileHdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t capacity;
+  uint64_t head;
+  uint64_t tail;
+};
+
+struct TraceRecHdr {
+  uint64_t ts_ns;
+  uint16_t len;
+  uint8_t kind;
+  uint8_t reserved[5];
+};
+
+struct TraceRecord {
+  uint64_t ts_ns;
+  enum TraceKind kind;
+  const unsigned char *data;
+  size_t len;
+};
+
+// Appends records to a memory-mapped trace file without syscalls.
+struct TraceWriter {
+  unsigned char *map;
+  size_t map_len;
+  struct TraceFileHdr *hdr;
+  unsigned char *data;
+};
+
+struct TraceReader {
+  unsigned char *map;
+  size_t map_len;
+  const struct TraceFileHdr *hdr;
+  const unsigned char *data;
+  uint64_t pos;
+};
+
+int TraceWriterOpen(struct TraceWriter *tw, const char *path,
+                    uint64_t capacity);
+void TraceAppend(struct TraceWriter *tw, enum TraceKind kind,
+                 const void *buf, size_t len);
+void TraceWriterClose(struct TraceWriter *tw);
+
+int TraceReaderOpen(struct TraceReader *tr, const char *path);
+bool TraceNext(struct TraceReader *tr, struct TraceRecord *rec);
+void TraceRewind(struct TraceReader *tr);
+void TraceReaderClose(struct TraceReader *tr);
+
+#endif